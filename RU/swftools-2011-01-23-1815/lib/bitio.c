@@ -38,6 +38,10 @@
 #include <zlib.h>
 #define ZLIB_BUFFER_SIZE 16384
 #endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define PARALLEL_DEFLATE
+#endif
 #include "./bitio.h"
 
 /* ---------------------------- null reader ------------------------------- */
@@ -353,6 +357,7 @@ void writer_init_filewriter(writer_t*w, int handle)
     mr->free_handle = 0;
     memset(w, 0, sizeof(writer_t));
     w->write = writer_filewrite_write;
+    w->flush = dummy_flush;
     w->finish = writer_filewrite_finish;
     w->internal = mr;
     w->type = WRITER_TYPE_FILE;
@@ -399,6 +404,44 @@ void writer_init_nullwriter(writer_t*w)
     w->mybyte = 0;
     w->pos = 0;
 }
+
+/* ---------------------------- patching ------------------------------- */
+
+/* overwrite len bytes at position pos (as in w->pos) of data already written.
+   Returns len, or -1 if the writer can't go back (pipes, zlib, custom writers).
+   len=0 only checks whether patching is possible. */
+int writer_patch(writer_t*w, int pos, void*data, int len)
+{
+    if(pos < 0 || pos+len > w->pos)
+	return -1;
+    if(w->type == WRITER_TYPE_NULL) {
+	return len;
+    } else if(w->type == WRITER_TYPE_MEM) {
+	memwrite_t*mw = (memwrite_t*)w->internal;
+	memcpy(&mw->data[pos], data, len);
+	return len;
+    } else if(w->type == WRITER_TYPE_GROWING_MEM) {
+	growmemwrite_t*mw = (growmemwrite_t*)w->internal;
+	if(!mw->data)
+	    return -1;
+	memcpy(&mw->data[pos], data, len);
+	return len;
+    } else if(w->type == WRITER_TYPE_FILE) {
+	filewrite_t*fw = (filewrite_t*)w->internal;
+	off_t end = lseek(fw->handle, 0, SEEK_CUR);
+	int ret;
+	if(end < 0)
+	    return -1;
+	if(!len)
+	    return 0;
+	if(lseek(fw->handle, end - (w->pos - pos), SEEK_SET) < 0)
+	    return -1;
+	ret = write(fw->handle, data, len);
+	lseek(fw->handle, end, SEEK_SET);
+	return ret;
+    }
+    return -1;
+}
 /* ---------------------------- zlibinflate reader -------------------------- */
 
 typedef struct _zlibinflate
@@ -672,6 +715,289 @@ void writer_init_zlibdeflate(writer_t*w, writer_t*output)
 #endif
 }
 
+/* ----------------------- parallel zlib deflate writer ---------------------- */
+
+/* Like the zlibdeflate writer, but the data is cut into blocks which are
+   compressed on several threads. Each block is primed with the preceding
+   32k of input as dictionary and ends with a sync flush, so the blocks can
+   simply be concatenated into one zlib stream (this is what pigz does).
+   The Adler-32 checksums of the blocks are combined for the trailer. */
+
+#define PDEFLATE_WINDOW 32768
+#define PDEFLATE_DEFAULT_BLOCKSIZE (128*1024)
+
+typedef struct _pdeflate_block
+{
+#ifdef HAVE_ZLIB
+    unsigned char*data;
+    int len;
+    unsigned char*dict;
+    int dictlen;
+    unsigned char*out;
+    int outlen;
+    int outsize;
+    uLong adler;
+    int level;
+    char last;
+#endif
+} pdeflate_block_t;
+
+typedef struct _pdeflate
+{
+#ifdef HAVE_ZLIB
+    writer_t*output;
+    int level;
+    int blocksize;
+    int threads;
+    pdeflate_block_t*blocks; // one per thread
+    int num; // number of full blocks
+    unsigned char dict[PDEFLATE_WINDOW]; // the last input before blocks[0]
+    int dictlen;
+    uLong adler;
+    char header_written;
+#endif
+} pdeflate_t;
+
+#ifdef HAVE_ZLIB
+static void pdeflate_compress_block(pdeflate_block_t*b)
+{
+    z_stream zs;
+    int ret;
+    memset(&zs, 0, sizeof(z_stream));
+    ret = deflateInit2(&zs, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) zlib_error(ret, "bitio:pdeflate_init", &zs);
+    if(b->dictlen) {
+	ret = deflateSetDictionary(&zs, b->dict, b->dictlen);
+	if (ret != Z_OK) zlib_error(ret, "bitio:pdeflate_dictionary", &zs);
+    }
+    zs.next_in = b->data;
+    zs.avail_in = b->len;
+    b->outlen = 0;
+    while(1) {
+	if(b->outsize - b->outlen < 64) {
+	    b->outsize += b->outsize/2 + 1024;
+	    b->out = (unsigned char*)realloc(b->out, b->outsize);
+	}
+	zs.next_out = b->out + b->outlen;
+	zs.avail_out = b->outsize - b->outlen;
+	ret = deflate(&zs, b->last?Z_FINISH:Z_SYNC_FLUSH);
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) 
+	    zlib_error(ret, "bitio:pdeflate_deflate", &zs);
+	b->outlen = b->outsize - zs.avail_out;
+	if(ret == Z_STREAM_END || (!b->last && zs.avail_out))
+	    break;
+    }
+    ret = deflateEnd(&zs);
+    if (ret != Z_OK && ret != Z_DATA_ERROR) zlib_error(ret, "bitio:pdeflate_end", &zs);
+    b->adler = adler32(adler32(0, 0, 0), b->data, b->len);
+}
+#ifdef PARALLEL_DEFLATE
+static void* pdeflate_thread(void*b)
+{
+    pdeflate_compress_block((pdeflate_block_t*)b);
+    return 0;
+}
+#endif
+
+/* compress blocks[0..num-1], plus the partially filled blocks[num] if it
+   isn't empty or if this is the end of the stream, and write them out */
+static void pdeflate_run(writer_t*writer, char last)
+{
+    pdeflate_t*p = (pdeflate_t*)writer->internal;
+    int num = p->num;
+    int t;
+#ifdef PARALLEL_DEFLATE
+    pthread_t*threads = (pthread_t*)malloc(sizeof(pthread_t)*p->threads);
+    char*started = (char*)malloc(p->threads);
+#endif
+    if(num < p->threads && (p->blocks[num].len || last))
+	num++;
+
+    for(t=0;t<num;t++) {
+	pdeflate_block_t*b = &p->blocks[t];
+	b->level = p->level;
+	b->last = last && t==num-1;
+	if(t) {
+	    b->dict = p->blocks[t-1].data + p->blocks[t-1].len - PDEFLATE_WINDOW;
+	    b->dictlen = PDEFLATE_WINDOW;
+	} else {
+	    b->dict = p->dict + PDEFLATE_WINDOW - p->dictlen;
+	    b->dictlen = p->dictlen;
+	}
+    }
+#ifdef PARALLEL_DEFLATE
+    for(t=1;t<num;t++)
+	started[t] = !pthread_create(&threads[t], 0, pdeflate_thread, &p->blocks[t]);
+    if(num)
+	pdeflate_compress_block(&p->blocks[0]);
+    for(t=1;t<num;t++) {
+	if(started[t])
+	    pthread_join(threads[t], 0);
+	else
+	    pdeflate_compress_block(&p->blocks[t]);
+    }
+    free(threads);
+    free(started);
+#else
+    for(t=0;t<num;t++)
+	pdeflate_compress_block(&p->blocks[t]);
+#endif
+
+    if(!p->header_written) {
+	/* same header as zlib would write for this level (see deflate.c):
+	   32k window, FLEVEL 0 for levels 0-1, 1 for 2-5, 2 for 6, 3 for 7-9 */
+	int level = p->level == Z_DEFAULT_COMPRESSION ? 6 : p->level;
+	int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	int head = (0x78<<8) + (flevel<<6);
+	unsigned char h[2];
+	head += 31 - head%31;
+	h[0] = head>>8;
+	h[1] = head;
+	p->output->write(p->output, h, 2);
+	writer->pos += 2;
+	p->header_written = 1;
+    }
+    for(t=0;t<num;t++) {
+	pdeflate_block_t*b = &p->blocks[t];
+	p->output->write(p->output, b->out, b->outlen);
+	writer->pos += b->outlen;
+	p->adler = adler32_combine(p->adler, b->adler, b->len);
+
+	/* keep the last 32k of input as dictionary for what follows */
+	if(b->len >= PDEFLATE_WINDOW) {
+	    memcpy(p->dict, b->data + b->len - PDEFLATE_WINDOW, PDEFLATE_WINDOW);
+	    p->dictlen = PDEFLATE_WINDOW;
+	} else if(b->len) {
+	    memmove(p->dict, p->dict + b->len, PDEFLATE_WINDOW - b->len);
+	    memcpy(p->dict + PDEFLATE_WINDOW - b->len, b->data, b->len);
+	    p->dictlen += b->len;
+	    if(p->dictlen > PDEFLATE_WINDOW)
+		p->dictlen = PDEFLATE_WINDOW;
+	}
+	b->len = 0;
+    }
+    if(last) {
+	unsigned char a[4];
+	a[0] = p->adler>>24;
+	a[1] = p->adler>>16;
+	a[2] = p->adler>>8;
+	a[3] = p->adler;
+	p->output->write(p->output, a, 4);
+	writer->pos += 4;
+    }
+    p->num = 0;
+}
+#endif
+
+static int writer_pdeflate_write(writer_t*writer, void* data, int len) 
+{
+#ifdef HAVE_ZLIB
+    pdeflate_t*p = (pdeflate_t*)writer->internal;
+    unsigned char*d = (unsigned char*)data;
+    int left = len;
+    if(writer->type != WRITER_TYPE_ZLIB_PARALLEL || !p) {
+	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
+	return 0;
+    }
+    while(left) {
+	pdeflate_block_t*b = &p->blocks[p->num];
+	int l = p->blocksize - b->len;
+	if(l > left)
+	    l = left;
+	memcpy(b->data + b->len, d, l);
+	b->len += l;
+	d += l;
+	left -= l;
+	if(b->len == p->blocksize) {
+	    p->num++;
+	    if(p->num == p->threads)
+		pdeflate_run(writer, 0);
+	}
+    }
+    return len;
+#else
+    fprintf(stderr, "Error: swftools was compiled without zlib support");
+    exit(1);
+#endif
+}
+
+static void writer_pdeflate_flush(writer_t*writer)
+{
+#ifdef HAVE_ZLIB
+    if(writer->type != WRITER_TYPE_ZLIB_PARALLEL || !writer->internal) {
+	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
+	return;
+    }
+    pdeflate_run(writer, 0);
+#endif
+}
+
+static void writer_pdeflate_finish(writer_t*writer)
+{
+#ifdef HAVE_ZLIB
+    pdeflate_t*p = (pdeflate_t*)writer->internal;
+    int t;
+    if(writer->type != WRITER_TYPE_ZLIB_PARALLEL || !p) {
+	fprintf(stderr, "Wrong writer ID (writer not initialized?)\n");
+	return;
+    }
+    pdeflate_run(writer, 1);
+    for(t=0;t<p->threads;t++) {
+	free(p->blocks[t].data);
+	free(p->blocks[t].out);
+    }
+    free(p->blocks);
+    free(p);
+    memset(writer, 0, sizeof(writer_t));
+#endif
+}
+
+void writer_init_zlibdeflate_parallel(writer_t*w, writer_t*output, int level, int blocksize, int threads)
+{
+#ifdef HAVE_ZLIB
+    pdeflate_t*p;
+    int t;
+    if(threads <= 0) {
+#if defined(PARALLEL_DEFLATE) && defined(_SC_NPROCESSORS_ONLN)
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(threads <= 0)
+	    threads = 1;
+    }
+    if(blocksize <= 0)
+	blocksize = PDEFLATE_DEFAULT_BLOCKSIZE;
+    if(blocksize < PDEFLATE_WINDOW)
+	blocksize = PDEFLATE_WINDOW;
+
+    memset(w, 0, sizeof(writer_t));
+    p = (pdeflate_t*)malloc(sizeof(pdeflate_t));
+    memset(p, 0, sizeof(pdeflate_t));
+    p->output = output;
+    p->level = level;
+    p->blocksize = blocksize;
+    p->threads = threads;
+    p->adler = adler32(0, 0, 0);
+    p->blocks = (pdeflate_block_t*)malloc(sizeof(pdeflate_block_t)*threads);
+    memset(p->blocks, 0, sizeof(pdeflate_block_t)*threads);
+    for(t=0;t<threads;t++) {
+	p->blocks[t].data = (unsigned char*)malloc(blocksize);
+	p->blocks[t].outsize = blocksize + blocksize/8 + 1024;
+	p->blocks[t].out = (unsigned char*)malloc(p->blocks[t].outsize);
+    }
+    w->internal = p;
+    w->write = writer_pdeflate_write;
+    w->flush = writer_pdeflate_flush;
+    w->finish = writer_pdeflate_finish;
+    w->type = WRITER_TYPE_ZLIB_PARALLEL;
+    w->bitpos = 0;
+    w->mybyte = 0;
+    w->pos = 0;
+#else
+    fprintf(stderr, "Error: swftools was compiled without zlib support");
+    exit(1);
+#endif
+}
+
 /* ----------------------- bit handling routines -------------------------- */
 
 void writer_writebit(writer_t*w, int bit)
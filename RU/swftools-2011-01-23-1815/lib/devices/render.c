@@ -48,6 +48,8 @@ typedef struct _internal_result {
     gfximage_t img;
     struct _internal_result*next;
     char palette;
+    int zlibthreads;
+    int zlibblocksize;
 } internal_result_t;
 
 typedef struct _clipbuffer {
@@ -69,6 +71,9 @@ typedef struct _internal {
 
     char palette;
 
+    int zlibthreads;
+    int zlibblocksize;
+
     RGBA* img;
 
     clipbuffer_t*clipbuf;
@@ -523,6 +528,12 @@ int render_setparameter(struct _gfxdevice*dev, const char*key, const char*value)
     } else if(!strcmp(key, "palette")) {
 	i->palette = atoi(value);
 	return 1;
+    } else if(!strcmp(key, "zlibthreads")) {
+	i->zlibthreads = atoi(value);
+	return 1;
+    } else if(!strcmp(key, "zlibblocksize")) {
+	i->zlibblocksize = atoi(value)*1024;
+	return 1;
     }
     return 0;
 }
@@ -796,20 +807,14 @@ int render_result_save(gfxresult_t*r, const char*filename)
 	}
 	while(i->next) {
 	    sprintf(filenamebuf, "%s.%d.png", origname, nr);
-            if(!i->palette) {
-	        png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            } else {
-	        png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-            }
+	    png_write_threaded(filename, (unsigned char*)i->img.data, i->img.width, i->img.height,
+		    i->palette, i->zlibthreads, i->zlibblocksize);
 	    nr++;
 	}
 	free(origname);
     } else {
-        if(!i->palette) {
-	    png_write(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	} else {
-	    png_write_palette_based_2(filename, (unsigned char*)i->img.data, i->img.width, i->img.height);
-	}
+	png_write_threaded(filename, (unsigned char*)i->img.data, i->img.width, i->img.height,
+		i->palette, i->zlibthreads, i->zlibblocksize);
     }
     return 1;
 }
@@ -1013,6 +1018,8 @@ void render_endpage(struct _gfxdevice*dev)
     
     internal_result_t*ir= (internal_result_t*)rfx_calloc(sizeof(internal_result_t));
     ir->palette = i->palette;
+    ir->zlibthreads = i->zlibthreads;
+    ir->zlibblocksize = i->zlibblocksize;
 
     int y,x;
 
@@ -1059,6 +1066,8 @@ void gfxdevice_render_init(gfxdevice_t*dev)
     i->antialize = 1;
     i->multiply = 1;
     i->zoom = 1;
+    i->zlibthreads = 1;
+    i->zlibblocksize = 0;
 
     dev->setparameter = render_setparameter;
     dev->startpage = render_startpage;
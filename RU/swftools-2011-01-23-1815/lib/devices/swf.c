@@ -76,6 +76,33 @@ typedef struct _fontlist
     struct _fontlist*next;
 } fontlist_t;
 
+/* bitmaps already defined in this SWF, keyed by a hash of the source
+   pixels, the source size and the size of the defined bitmap */
+typedef struct _imagecache_entry
+{
+    U64 hash;
+    U64 hash2;
+    int width, height;
+    int newwidth, newheight;
+    int bitid;
+    struct _imagecache_entry*next; // hash chain
+    struct _imagecache_entry*lru_prev; // towards the most recently used
+    struct _imagecache_entry*lru_next;
+} imagecache_entry_t;
+
+typedef struct _imagecache
+{
+    imagecache_entry_t**hashtable;
+    int hashsize;
+    int num;
+    int maxnum;
+    imagecache_entry_t*lru_first;
+    imagecache_entry_t*lru_last;
+    int hits;
+    int misses;
+    int evicted;
+} imagecache_t;
+
 typedef long int twip;
 
 typedef struct _swfmatrix {
@@ -99,8 +126,11 @@ typedef struct _swfoutput_internal
     int config_frameresets;
     int config_linknameurl;
     int config_jpegquality;
+    int config_imagecache;
     int config_storeallcharacters;
     int config_enablezlib;
+    int config_zlibthreads;
+    int config_zlibblocksize;
     int config_insertstoptag;
     int config_showimages;
     int config_watermark;
@@ -163,15 +193,7 @@ typedef struct _swfoutput_internal
     U32 clipdepths[128];
     int clippos;
 
-    /* image cache */
-    /*
-    int pic_xids[1024];
-    int pic_yids[1024];
-    int pic_ids[1024];
-    int pic_width[1024];
-    int pic_height[1024];
-    int picpos;
-    */
+    imagecache_t imagecache;
 
     int frameno;
     int lastframeno;
@@ -231,6 +253,166 @@ static void swfoutput_linktourl(gfxdevice_t*dev, const char*url, gfxline_t*point
 
 static gfxresult_t* swf_finish(gfxdevice_t*driver);
 
+// --------------------------------------------------------------------
+
+#define ROTL64(x,r) (((x)<<(r))|((x)>>(64-(r))))
+static const U64 PRIME64_1 = 0x9e3779b185ebca87ull;
+static const U64 PRIME64_2 = 0xc2b2ae3d27d4eb4full;
+
+static inline U64 hash_round(U64 acc, U64 v)
+{
+    acc += v*PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc*PRIME64_1;
+}
+static inline U64 hash_mix(U64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/* two 64 bit hashes of the pixels, from four independent lanes so
+   that the loop isn't bound by the latency of a single multiply chain */
+static void image_hash(RGBA*data, int width, int height, U64*hash, U64*hash2)
+{
+    const U8*p = (const U8*)data;
+    size_t len = (size_t)width*height*sizeof(RGBA);
+    U64 seed = ((U64)width<<32) ^ (U32)height;
+    U64 l1 = seed + PRIME64_1 + PRIME64_2;
+    U64 l2 = seed + PRIME64_2;
+    U64 l3 = seed;
+    U64 l4 = seed - PRIME64_1;
+    U64 v[4];
+
+    while(len >= 32) {
+	memcpy(v, p, 32);
+	l1 = hash_round(l1, v[0]);
+	l2 = hash_round(l2, v[1]);
+	l3 = hash_round(l3, v[2]);
+	l4 = hash_round(l4, v[3]);
+	p += 32;
+	len -= 32;
+    }
+    /* RGBA data is a multiple of 4 bytes, pad the tail with zeros */
+    if(len) {
+	memset(v, 0, sizeof(v));
+	memcpy(v, p, len);
+	l1 = hash_round(l1, v[0]);
+	l2 = hash_round(l2, v[1]);
+	l3 = hash_round(l3, v[2]);
+	l4 = hash_round(l4, v[3]);
+    }
+    *hash = hash_mix(ROTL64(l1,1) + ROTL64(l2,7) + ROTL64(l3,12) + ROTL64(l4,18));
+    *hash2 = hash_mix((l1 ^ ROTL64(l3,29)) + (l2 ^ ROTL64(l4,37)) + PRIME64_2);
+}
+
+static void imagecache_unlink(imagecache_t*c, imagecache_entry_t*e)
+{
+    if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else c->lru_first = e->lru_next;
+    if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else c->lru_last = e->lru_prev;
+    e->lru_prev = e->lru_next = 0;
+}
+static void imagecache_push_front(imagecache_t*c, imagecache_entry_t*e)
+{
+    e->lru_prev = 0;
+    e->lru_next = c->lru_first;
+    if(c->lru_first) c->lru_first->lru_prev = e;
+    else c->lru_last = e;
+    c->lru_first = e;
+}
+
+/* drop the least recently used entry. The bitmap stays in the SWF,
+   it just won't be reused anymore */
+static void imagecache_evict(imagecache_t*c)
+{
+    imagecache_entry_t*e = c->lru_last;
+    if(!e)
+	return;
+    imagecache_unlink(c, e);
+    imagecache_entry_t**l = &c->hashtable[e->hash & (c->hashsize-1)];
+    while(*l != e)
+	l = &(*l)->next;
+    *l = e->next;
+    free(e);
+    c->num--;
+    c->evicted++;
+}
+
+static void imagecache_clear(imagecache_t*c)
+{
+    imagecache_entry_t*e = c->lru_first;
+    while(e) {
+	imagecache_entry_t*next = e->lru_next;
+	free(e);
+	e = next;
+    }
+    if(c->hashtable)
+	memset(c->hashtable, 0, sizeof(imagecache_entry_t*)*c->hashsize);
+    c->lru_first = c->lru_last = 0;
+    c->num = 0;
+}
+
+static imagecache_entry_t* imagecache_find(imagecache_t*c, U64 hash, U64 hash2, int width, int height, int newwidth, int newheight)
+{
+    if(!c->hashtable)
+	return 0;
+    imagecache_entry_t*e = c->hashtable[hash & (c->hashsize-1)];
+    while(e) {
+	if(e->hash == hash && e->hash2 == hash2 &&
+	   e->width == width && e->height == height &&
+	   e->newwidth == newwidth && e->newheight == newheight) {
+	    imagecache_unlink(c, e);
+	    imagecache_push_front(c, e);
+	    return e;
+	}
+	e = e->next;
+    }
+    return 0;
+}
+
+static void imagecache_add(imagecache_t*c, int maxnum, U64 hash, U64 hash2, int width, int height, int newwidth, int newheight, int bitid)
+{
+    if(maxnum<=0)
+	return;
+    while(c->num >= maxnum)
+	imagecache_evict(c);
+
+    if(c->num >= c->hashsize) {
+	/* grow the hash table to twice the size, rechaining all entries */
+	int newsize = c->hashsize ? c->hashsize*2 : 256;
+	imagecache_entry_t**newtable = (imagecache_entry_t**)rfx_calloc(sizeof(imagecache_entry_t*)*newsize);
+	imagecache_entry_t*e;
+	for(e=c->lru_first;e;e=e->lru_next) {
+	    imagecache_entry_t**l = &newtable[e->hash & (newsize-1)];
+	    e->next = *l;
+	    *l = e;
+	}
+	free(c->hashtable);
+	c->hashtable = newtable;
+	c->hashsize = newsize;
+    }
+
+    imagecache_entry_t*e = (imagecache_entry_t*)rfx_calloc(sizeof(imagecache_entry_t));
+    e->hash = hash;
+    e->hash2 = hash2;
+    e->width = width;
+    e->height = height;
+    e->newwidth = newwidth;
+    e->newheight = newheight;
+    e->bitid = bitid;
+    imagecache_entry_t**l = &c->hashtable[hash & (c->hashsize-1)];
+    e->next = *l;
+    *l = e;
+    imagecache_push_front(c, e);
+    c->num++;
+}
+
 static swfoutput_internal* init_internal_struct()
 {
     swfoutput_internal*i = (swfoutput_internal*)malloc(sizeof(swfoutput_internal));
@@ -273,9 +455,12 @@ static swfoutput_internal* init_internal_struct()
     i->config_ignoredraworder=0;
     i->config_drawonlyshapes=0;
     i->config_jpegquality=85;
+    i->config_imagecache=4096;
     i->config_storeallcharacters=0;
     i->config_dots=1;
     i->config_enablezlib=0;
+    i->config_zlibthreads=1;
+    i->config_zlibblocksize=0;
     i->config_insertstoptag=0;
     i->config_flashversion=6;
     i->config_framerate=0.25;
@@ -1136,6 +1321,8 @@ void swf_endframe(gfxdevice_t*dev)
 	    swf_SetU16(i->tag,i->currentswfid);
 	}
 	i->currentswfid = i->startids;
+	/* the cached bitmaps were freed, too */
+	imagecache_clear(&i->imagecache);
     }
 }
 
@@ -1533,9 +1720,18 @@ void swfoutput_finalize(gfxdevice_t*dev)
 //	swf_Optimize(i->swf);
 }
 
+/* the finished SWF, and how to compress it when saving */
+typedef struct _swfresult {
+    SWF*swf;
+    int zlibthreads;
+    int zlibblocksize;
+} swfresult_t;
+
 int swfresult_save(gfxresult_t*gfx, const char*filename)
 {
-    SWF*swf = (SWF*)gfx->internal;
+    swfresult_t*r = (swfresult_t*)gfx->internal;
+    SWF*swf = r->swf;
+    writer_t writer;
     int fi;
     if(filename)
      fi = open(filename, O_BINARY|O_CREAT|O_TRUNC|O_WRONLY, 0777);
@@ -1547,8 +1743,10 @@ int swfresult_save(gfxresult_t*gfx, const char*filename)
 	return -1;
     }
     
-    if FAILED(swf_WriteSWF(fi,swf)) 
+    writer_init_filewriter(&writer, fi);
+    if FAILED(swf_WriteSWF3(&writer,swf,r->zlibthreads,r->zlibblocksize)) 
         msg("<error> WriteSWF() failed.\n");
+    writer.finish(&writer);
 
     if(filename)
      close(fi);
@@ -1556,7 +1754,7 @@ int swfresult_save(gfxresult_t*gfx, const char*filename)
 }
 void* swfresult_get(gfxresult_t*gfx, const char*name)
 {
-    SWF*swf = (SWF*)gfx->internal;
+    SWF*swf = ((swfresult_t*)gfx->internal)->swf;
     if(!strcmp(name, "swf")) {
 	return (void*)swf_CopySWF(swf);
     } else if(!strcmp(name, "xmin")) {
@@ -1577,8 +1775,10 @@ void* swfresult_get(gfxresult_t*gfx, const char*name)
 void swfresult_destroy(gfxresult_t*gfx)
 {
     if(gfx->internal) {
-	swf_FreeTags((SWF*)gfx->internal);
-	free(gfx->internal);
+	swfresult_t*r = (swfresult_t*)gfx->internal;
+	swf_FreeTags(r->swf);
+	free(r->swf);
+	free(r);
 	gfx->internal = 0;
     }
     memset(gfx, 0, sizeof(gfxresult_t));
@@ -1591,6 +1791,7 @@ gfxresult_t* swf_finish(gfxdevice_t* dev)
 {
     swfoutput_internal*i = (swfoutput_internal*)dev->internal;
     gfxresult_t*result;
+    swfresult_t*r;
 
     if(i->config_linktarget) {
 	free(i->config_linktarget);
@@ -1598,11 +1799,18 @@ gfxresult_t* swf_finish(gfxdevice_t* dev)
     }
 
     swfoutput_finalize(dev);
-    SWF* swf = i->swf;i->swf = 0;
+    if(i->imagecache.hits || i->imagecache.misses) {
+	msg("<verbose> Image cache: %d bitmaps reused, %d defined, %d evicted",
+		i->imagecache.hits, i->imagecache.misses, i->imagecache.evicted);
+    }
+    r = (swfresult_t*)rfx_calloc(sizeof(swfresult_t));
+    r->swf = i->swf;i->swf = 0;
+    r->zlibthreads = i->config_zlibthreads;
+    r->zlibblocksize = i->config_zlibblocksize;
     swfoutput_destroy(dev);
 
     result = (gfxresult_t*)rfx_calloc(sizeof(gfxresult_t));
-    result->internal = swf;
+    result->internal = r;
     result->save = swfresult_save;
     result->write = 0;
     result->get = swfresult_get;
@@ -1630,6 +1838,9 @@ static void swfoutput_destroy(gfxdevice_t* dev)
     }
     if(i->swf) {swf_FreeTags(i->swf);free(i->swf);i->swf = 0;}
 
+    imagecache_clear(&i->imagecache);
+    free(i->imagecache.hashtable);i->imagecache.hashtable = 0;
+
     free(i);i=0;
     memset(dev, 0, sizeof(gfxdevice_t));
 }
@@ -2073,6 +2284,10 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 	i->config_storeallcharacters = atoi(value);
     } else if(!strcmp(name, "enablezlib")) {
 	i->config_enablezlib = atoi(value);
+    } else if(!strcmp(name, "zlibthreads")) {
+	i->config_zlibthreads = atoi(value);
+    } else if(!strcmp(name, "zlibblocksize")) {
+	i->config_zlibblocksize = atoi(value)*1024;
     } else if(!strcmp(name, "bboxvars")) {
 	i->config_bboxvars = atoi(value);
     } else if(!strcmp(name, "dots")) {
@@ -2147,6 +2362,12 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
 	if(val<0) val=0;
 	if(val>101) val=101;
 	i->config_jpegquality = val;
+    } else if(!strcmp(name, "imagecache")) {
+	int val = atoi(value);
+	if(val<0) val=0;
+	i->config_imagecache = val;
+	while(i->imagecache.num > val)
+	    imagecache_evict(&i->imagecache);
     } else if(!strcmp(name, "splinequality")) {
 	int v = atoi(value);
 	v = 500-(v*5); // 100% = 0.25 pixel, 0% = 25 pixel
@@ -2180,6 +2401,8 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
         printf("linknameurl		    Link buttons will be named like the URL they refer to (handy for iterating through links with actionscript)\n");
         printf("storeallcharacters          don't reduce the fonts to used characters in the output file\n");
         printf("enablezlib                  switch on zlib compression (also done if flashversion>=6)\n");
+        printf("zlibthreads=<num>           compress on <num> threads (1), 0 for one per cpu\n");
+        printf("zlibblocksize=<kb>          size of the blocks compressed by each thread (128)\n");
         printf("bboxvars                    store the bounding box of the SWF file in actionscript variables\n");
         printf("dots                        Take care to handle dots correctly\n");
         printf("reordertags=0/1             (default: 1) perform some tag optimizations\n");
@@ -2195,6 +2418,7 @@ int swf_setparameter(gfxdevice_t*dev, const char*name, const char*value)
         printf("simpleviewer                Add next/previous buttons to the SWF\n");
         printf("animate                     insert a showframe tag after each placeobject (animate draw order of PDF files)\n");
         printf("jpegquality=<quality>       set compression quality of jpeg images\n");
+        printf("imagecache=<num>            reuse up to <num> (4096) bitmaps for repeated images, 0 to disable\n");
 	printf("splinequality=<value>       Set the quality of spline convertion to value (0-100, default: 100).\n");
 	printf("disablelinks                Disable links.\n");
     } else {
@@ -2228,15 +2452,6 @@ static CXFORM gfxcxform_to_cxform(gfxcxform_t* c)
     return cx;
 }
 
-/* TODO */
-static int imageInCache(gfxdevice_t*dev, void*data, int width, int height)
-{
-    return -1;
-}
-static void addImageToCache(gfxdevice_t*dev, void*data, int width, int height)
-{
-}
-    
 static int add_image(swfoutput_internal*i, gfximage_t*img, int targetwidth, int targetheight, int* newwidth, int* newheight)
 {
     gfxdevice_t*dev = i->dev;
@@ -2267,7 +2482,25 @@ static int add_image(swfoutput_internal*i, gfximage_t*img, int targetwidth, int
     if(newsizey<=0)
 	newsizey = 1;
 
-    /* TODO: cache images */
+    /* images repeated in the document (logos, backgrounds, tiles)
+       reuse the bitmap defined the first time */
+    int cachewidth = sizex, cacheheight = sizey;
+    if(newsizex<sizex || newsizey<sizey) {
+	cachewidth = newsizex;
+	cacheheight = newsizey;
+    }
+    U64 hash=0, hash2=0;
+    if(i->config_imagecache) {
+	image_hash(mem, sizex, sizey, &hash, &hash2);
+	imagecache_entry_t*e = imagecache_find(&i->imagecache, hash, hash2, sizex, sizey, cachewidth, cacheheight);
+	if(e) {
+	    i->imagecache.hits++;
+	    msg("<verbose> Reusing bitmap (id %d) for %dx%d image", e->bitid, sizex, sizey);
+	    *newwidth = e->newwidth;
+	    *newheight = e->newheight;
+	    return e->bitid;
+	}
+    }
     
     if(newsizex<sizex || newsizey<sizey) {
 	msg("<verbose> Scaling %dx%d image to %dx%d", sizex, sizey, newsizex, newsizey);
@@ -2305,16 +2538,13 @@ static int add_image(swfoutput_internal*i, gfximage_t*img, int targetwidth, int
     }
     printf("\n");*/
 
-    int bitid = -1;
-    int cacheid = imageInCache(dev, mem, sizex, sizey);
-
-    if(cacheid<=0) {
-	bitid = getNewID(dev);
+    int bitid = getNewID(dev);
 
-	i->tag = swf_AddImage(i->tag, bitid, mem, sizex, sizey, i->config_jpegquality);
-	addImageToCache(dev, mem, sizex, sizey);
-    } else {
-	bitid = cacheid;
+    i->tag = swf_AddImage(i->tag, bitid, mem, sizex, sizey, i->config_jpegquality);
+    if(i->config_imagecache) {
+	i->imagecache.misses++;
+	imagecache_add(&i->imagecache, i->config_imagecache, hash, hash2,
+		img->width, img->height, cachewidth, cacheheight, bitid);
     }
 
     if(newpic)
@@ -31,6 +31,10 @@
 #endif
 #include <fcntl.h>
 #include <ctype.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define ADDIMAGE_THREADS
+#endif
 
 #ifdef HAVE_JPEGLIB
 #define HAVE_BOOLEAN
@@ -894,7 +898,7 @@ void swf_SetLosslessImage(TAG*tag, RGBA*data, int width, int height)
     if(num>1 && num<=256) {
 	RGBA*palette = (RGBA*)malloc(sizeof(RGBA)*num);
 	int width2 = BYTES_PER_SCANLINE(width);
-	U8*data2 = (U8*)malloc(width2*height);
+	U8*data2 = (U8*)rfx_calloc(width2*height);
 	int len = width*height;
 	int x,y;
 	int r;
@@ -918,7 +922,7 @@ void swf_SetLosslessImage(TAG*tag, RGBA*data, int width, int height)
 	    }
 	}
 	swf_SetLosslessBitsIndexed(tag, width, height, data2, palette, num);
-	free(data2);
+	rfx_free(data2);
 	free(palette);
     } else {
 	swf_SetLosslessBits(tag, width, height, data, BMF_32BIT);
@@ -1152,49 +1156,211 @@ int swf_SetJPEGBits3(TAG * tag, U16 width, U16 height, RGBA * bitmap, int qualit
 #endif
 
 
-/* expects mem to be non-premultiplied */
+#define ADDIMAGE_LOSSLESS -1
+#define ADDIMAGE_AMBIGUOUS 0
+#define ADDIMAGE_JPEG 1
+
+/* the estimate looks at ADDIMAGE_BANDS bands of ADDIMAGE_BANDHEIGHT rows each.
+   Bands are a multiple of 8 rows high so they don't share jpeg blocks. */
+#define ADDIMAGE_BANDS 8
+#define ADDIMAGE_BANDHEIGHT 8
+
+static TAG* addimage_lossless(int bitid, RGBA*mem, int width, int height)
+{
+    TAG*tag = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
+    swf_SetU16(tag, bitid);
+    swf_SetLosslessImage(tag, mem, width, height);
+    return tag;
+}
+
+#ifdef HAVE_JPEGLIB
+/* expects mem to be premultiplied if has_alpha is set */
+static TAG* addimage_jpeg(int bitid, RGBA*mem, int width, int height, int quality, int has_alpha)
+{
+    TAG*tag;
+    if(has_alpha) {
+	tag = swf_InsertTag(0, ST_DEFINEBITSJPEG3);
+	swf_SetU16(tag, bitid);
+	swf_SetJPEGBits3(tag, width, height, mem, quality);
+    } else {
+	tag = swf_InsertTag(0, ST_DEFINEBITSJPEG2);
+	swf_SetU16(tag, bitid);
+	swf_SetJPEGBits2(tag, width, height, mem, quality);
+    }
+    return tag;
+}
+
+/* guess which of the two encodings will produce the smaller tag, without
+   running them on the whole image:
+   - a handful of colors means a small indexed lossless image
+   - many colors in smooth continuous tone (no flat runs, no hard edges)
+     favor jpeg
+   - otherwise, both encoders are run on a few bands of the image and the
+     sizes compared. If they are close, ADDIMAGE_AMBIGUOUS is returned */
+static int addimage_estimate(RGBA*mem, int width, int height, int quality, int has_alpha)
+{
+    int rows = ADDIMAGE_BANDS*ADDIMAGE_BANDHEIGHT;
+    RGBA*sample;
+    int num, t, x, y;
+    int pairs = 0, flat = 0, edges = 0;
+    TAG*lossless, *jpeg;
+    int result;
+
+    /* for small images, the trial would cost as much as the real thing */
+    if(height < rows*4 || width < 16)
+	return ADDIMAGE_AMBIGUOUS;
+
+    sample = (RGBA*)rfx_alloc(width*rows*sizeof(RGBA));
+    for(t=0;t<ADDIMAGE_BANDS;t++) {
+	int band = (height-ADDIMAGE_BANDHEIGHT)*t/(ADDIMAGE_BANDS-1);
+	band &= ~7;
+	memcpy(&sample[width*ADDIMAGE_BANDHEIGHT*t], &mem[width*band],
+		width*ADDIMAGE_BANDHEIGHT*sizeof(RGBA));
+    }
+
+    /* if the bands have only a handful of colors, the whole image might,
+       too. The full count stops as soon as it runs out of palette entries. */
+    num = swf_ImageGetNumberOfPaletteEntries(sample, width, rows, 0);
+    if(num<=16)
+	num = swf_ImageGetNumberOfPaletteEntries(mem, width, height, 0);
+    if(num<=16) {
+	rfx_free(sample);
+	return ADDIMAGE_LOSSLESS;
+    }
+
+    for(y=0;y<rows;y++) {
+	RGBA*line = &sample[width*y];
+	for(x=1;x<width;x++) {
+	    int d = abs(line[x].r - line[x-1].r) +
+		    abs(line[x].g - line[x-1].g) +
+		    abs(line[x].b - line[x-1].b) +
+		    abs(line[x].a - line[x-1].a);
+	    if(!d)
+		flat++;
+	    else if(d > 96)
+		edges++;
+	    pairs++;
+	}
+    }
+    if(num>256 && flat*10 < pairs && edges*100 < pairs) {
+	rfx_free(sample);
+	return ADDIMAGE_JPEG;
+    }
+
+    /* trial encode. swf_SetLosslessImage premultiplies the sample, which
+       is what the jpeg encoder would get as well */
+    lossless = addimage_lossless(0, sample, width, rows);
+    jpeg = addimage_jpeg(0, sample, width, rows, quality, has_alpha);
+    if(lossless->len*5 < jpeg->len*4)
+	result = ADDIMAGE_LOSSLESS;
+    else if(jpeg->len*5 < lossless->len*4)
+	result = ADDIMAGE_JPEG;
+    else
+	result = ADDIMAGE_AMBIGUOUS;
+    swf_DeleteTag(0, lossless);
+    swf_DeleteTag(0, jpeg);
+    rfx_free(sample);
+    return result;
+}
+#endif
+
+#ifdef ADDIMAGE_THREADS
+typedef struct _losslessjob {
+    TAG*tag;
+    int bitid;
+    RGBA*mem;
+    int width, height;
+} losslessjob_t;
+
+static void* addimage_lossless_thread(void*_job)
+{
+    losslessjob_t*job = (losslessjob_t*)_job;
+    job->tag = addimage_lossless(job->bitid, job->mem, job->width, job->height);
+    return 0;
+}
+#endif
+
+/* expects mem to be non-premultiplied. If the image has alpha,
+   mem will be premultiplied afterwards. */
 TAG* swf_AddImage(TAG*tag, int bitid, RGBA*mem, int width, int height, int quality)
 {
     TAG *tag1 = 0, *tag2 = 0;
     int has_alpha = swf_ImageHasAlpha(mem,width,height);
-
-    /* try lossless image */
+    int mode = ADDIMAGE_AMBIGUOUS;
 
 #ifdef NO_LOSSLESS
-    tag1 = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
-    tag1->len = 0x7fffffff;
+    mode = ADDIMAGE_JPEG;
+#endif
+#ifndef HAVE_JPEGLIB
+    mode = ADDIMAGE_LOSSLESS;
 #else
-    tag1 = swf_InsertTag(0, /*ST_DEFINEBITSLOSSLESS1/2*/0);
-    swf_SetU16(tag1, bitid);
-    swf_SetLosslessImage(tag1, mem, width, height);
+    if(quality>100)
+	mode = ADDIMAGE_LOSSLESS;
+    else if(mode == ADDIMAGE_AMBIGUOUS)
+	mode = addimage_estimate(mem, width, height, quality, has_alpha);
 #endif
 
-#if defined(HAVE_JPEGLIB)
-    /* try jpeg image. Notice that if (and only if) we tried the lossless compression
-       above, the data will now be premultiplied with alpha. */
-    if(has_alpha) {
-	tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG3);
-	swf_SetU16(tag2, bitid);
-	swf_SetJPEGBits3(tag2, width, height, mem, quality);
+    if(mode == ADDIMAGE_LOSSLESS) {
+	tag1 = addimage_lossless(bitid, mem, width, height);
+    }
+#ifdef HAVE_JPEGLIB
+    else if(mode == ADDIMAGE_JPEG) {
+#ifndef NO_LOSSLESS
+	/* the jpeg encoder gets the same data it would have seen
+	   after a lossless attempt */
+	if(has_alpha)
+	    swf_PreMultiplyAlpha(mem, width, height);
+#endif
+	tag2 = addimage_jpeg(bitid, mem, width, height, quality, has_alpha);
     } else {
-	tag2 = swf_InsertTag(0, ST_DEFINEBITSJPEG2);
-	swf_SetU16(tag2, bitid);
-	swf_SetJPEGBits2(tag2, width, height, mem, quality);
+	/* encode both, and keep the smaller one. The lossless encoder
+	   premultiplies mem in place, so the jpeg encoder works on a
+	   premultiplied copy. */
+	RGBA*jpegmem = mem;
+	if(has_alpha) {
+	    jpegmem = (RGBA*)rfx_alloc(width*height*sizeof(RGBA));
+	    memcpy(jpegmem, mem, width*height*sizeof(RGBA));
+	    swf_PreMultiplyAlpha(jpegmem, width, height);
+	}
+#ifdef ADDIMAGE_THREADS
+	{
+	    pthread_t thread;
+	    losslessjob_t job;
+	    job.tag = 0;
+	    job.bitid = bitid;
+	    job.mem = mem;
+	    job.width = width;
+	    job.height = height;
+	    if(!pthread_create(&thread, 0, addimage_lossless_thread, &job)) {
+		tag2 = addimage_jpeg(bitid, jpegmem, width, height, quality, has_alpha);
+		pthread_join(thread, 0);
+		tag1 = job.tag;
+	    }
+	}
+	if(!tag1)
+#endif
+	{
+	    tag1 = addimage_lossless(bitid, mem, width, height);
+	    if(!tag2)
+		tag2 = addimage_jpeg(bitid, jpegmem, width, height, quality, has_alpha);
+	}
+	if(jpegmem != mem)
+	    rfx_free(jpegmem);
     }
 #endif
 
-    if(quality>100 || !tag2 || (tag1 && tag1->len < tag2->len)) {
+    if(!tag2 || (tag1 && tag1->len < tag2->len)) {
 	/* use the zlib version- it's smaller */
 	tag1->prev = tag;
 	if(tag) tag->next = tag1;
 	tag = tag1;
-	swf_DeleteTag(0, tag2);
+	if(tag2) swf_DeleteTag(0, tag2);
     } else {
 	/* use the jpeg version- it's smaller */
 	tag2->prev = tag;
 	if(tag) tag->next = tag2;
 	tag = tag2;
-	swf_DeleteTag(0, tag1);
+	if(tag1) swf_DeleteTag(0, tag1);
     }
     return tag;
 }
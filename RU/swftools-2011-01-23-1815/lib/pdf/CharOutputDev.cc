@@ -573,13 +573,17 @@ static void showFontError(GfxFont*font, int nr)
 {  
     Ref*r=font->getID();
     int t;
+    lockGfxGlobals();
     for(t=0;t<lastdumppos;t++)
 	if(lastdumps[t] == r->num)
 	    break;
-    if(t < lastdumppos)
+    if(t < lastdumppos) {
+      unlockGfxGlobals();
       return;
+    }
     if(lastdumppos<sizeof(lastdumps)/sizeof(int))
     lastdumps[lastdumppos++] = r->num;
+    unlockGfxGlobals();
     if(nr == 0)
       msg("<warning> The following font caused problems:");
     else if(nr == 1)
@@ -691,8 +695,8 @@ GBool CharOutputDev::useDrawChar()
 const char*renderModeDesc[]= {"fill", "stroke", "fill+stroke", "invisible",
                       "clip+fill", "stroke+clip", "fill+stroke+clip", "clip"};
 
-static char tmp_printstr[4096];
-char* makeStringPrintable(char*str)
+/* buf needs room for 84 chars */
+static char* makeStringPrintable(char*str, char*buf)
 {
     int len = strlen(str);
     int dots = 0;
@@ -706,15 +710,15 @@ char* makeStringPrintable(char*str)
 	if(c<32 || c>124) {
 	    c = '.';
 	}
-	tmp_printstr[t] = c;
+	buf[t] = c;
     }
     if(dots) {
-	tmp_printstr[len++] = '.';
-	tmp_printstr[len++] = '.';
-	tmp_printstr[len++] = '.';
+	buf[len++] = '.';
+	buf[len++] = '.';
+	buf[len++] = '.';
     }
-    tmp_printstr[len] = 0;
-    return tmp_printstr;
+    buf[len] = 0;
+    return buf;
 }
 
 void CharOutputDev::updateTextMat(GfxState*state)
@@ -727,7 +731,8 @@ void CharOutputDev::beginString(GfxState *state, GString *s)
     if(current_text_stroke) {
 	msg("<error> Error: Incompatible change of text rendering to %d while inside cliptext", render);
     }
-    msg("<trace> beginString(%s) render=%d", makeStringPrintable(s->getCString()), render);
+    char printstr[84];
+    msg("<trace> beginString(%s) render=%d", makeStringPrintable(s->getCString(), printstr), render);
 }
 
 static gfxline_t* mkEmptyGfxShape(double x, double y)
@@ -750,10 +755,14 @@ void CharOutputDev::drawChar(GfxState *state, double x, double y,
     }
 
     gfxfont_t*current_gfxfont = current_fontinfo->getGfxFont();
-    if(!current_fontinfo->seen) {
+    /* the font infos are shared by all rendering threads */
+    lockGfxGlobals();
+    char firstuse = !current_fontinfo->seen;
+    current_fontinfo->seen = 1;
+    unlockGfxGlobals();
+    if(firstuse) {
 	dumpFontInfo("<verbose>", state->getFont());
 	device->addfont(device, current_gfxfont);
-        current_fontinfo->seen = 1;
     }
 
     CharCode glyphid = current_fontinfo->glyphs[charid]->glyphid;
@@ -1130,10 +1139,13 @@ void CharOutputDev::processLink(Link *link, Catalog *catalog)
 
     if(!s) s = strdup("-?-");
     
-    if(!getGfxGlobals()->linkinfo && (page || s))
+    lockGfxGlobals();
+    char linkinfo = getGfxGlobals()->linkinfo;
+    getGfxGlobals()->linkinfo = 1;
+    unlockGfxGlobals();
+    if(!linkinfo && (page || s))
     {
         msg("<notice> File contains links");
-        getGfxGlobals()->linkinfo = 1;
     }
    
     char*action = 0;
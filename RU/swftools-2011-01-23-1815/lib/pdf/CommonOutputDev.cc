@@ -2,6 +2,9 @@
 #include "CommonOutputDev.h"
 #include "../log.h"
 #include "../gfxdevice.h"
+#ifdef MULTITHREADED
+#include "GMutex.h"
+#endif
 
 int config_break_on_warning = 0;
 
@@ -62,8 +65,17 @@ GBool CommonOutputDev::interpretType3Chars()
     return gTrue;
 }
 
+#ifdef MULTITHREADED
+/* pages may be rendered by several threads at once (see pdf.cc), which
+   is only done after the globals have been created */
+static GMutex globalsMutex;
+#endif
+
 GFXOutputGlobals::GFXOutputGlobals()
 {
+#ifdef MULTITHREADED
+    gInitMutex(&globalsMutex);
+#endif
     this->featurewarnings = 0;
     this->jpeginfo = 0;
     this->textmodeinfo = 0;
@@ -83,11 +95,14 @@ GFXOutputGlobals::~GFXOutputGlobals()
 	f = next;
     }
     this->featurewarnings = 0;
+#ifdef MULTITHREADED
+    gDestroyMutex(&globalsMutex);
+#endif
 }
 
 static GFXOutputGlobals*gfxglobals=0;
 
-static void showfeature(const char*feature, char fully, char warn)
+static char addfeature(const char*feature)
 {
     if(!gfxglobals)
 	gfxglobals = new GFXOutputGlobals();
@@ -95,13 +110,23 @@ static void showfeature(const char*feature, char fully, char warn)
     feature_t*f = gfxglobals->featurewarnings;
     while(f) {
 	if(!strcmp(feature, f->string))
-	    return;
+	    return 0;
 	f = f->next;
     }
     f = (feature_t*)malloc(sizeof(feature_t));
     f->string = strdup(feature);
     f->next = gfxglobals->featurewarnings;
     gfxglobals->featurewarnings = f;
+    return 1;
+}
+
+static void showfeature(const char*feature, char fully, char warn)
+{
+    lockGfxGlobals();
+    char isnew = addfeature(feature);
+    unlockGfxGlobals();
+    if(!isnew)
+	return;
     if(warn) {
 	msg("<warning> %s not yet %ssupported!",feature,fully?"fully ":"");
     } else {
@@ -126,6 +151,19 @@ GFXOutputGlobals* getGfxGlobals()
 	gfxglobals = new GFXOutputGlobals();
     return gfxglobals;
 }
+void lockGfxGlobals()
+{
+#ifdef MULTITHREADED
+    getGfxGlobals();
+    gLockMutex(&globalsMutex);
+#endif
+}
+void unlockGfxGlobals()
+{
+#ifdef MULTITHREADED
+    gUnlockMutex(&globalsMutex);
+#endif
+}
 
 gfxcolor_t gfxstate_getfillcolor(GfxState * state)
 {
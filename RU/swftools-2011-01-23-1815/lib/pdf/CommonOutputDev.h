@@ -50,6 +50,11 @@ public:
 };
 extern GFXOutputGlobals* getGfxGlobals();
 
+/* serialize access to state shared by output devices rendering pages
+   in different threads (see pdf.cc). No-ops without MULTITHREADED. */
+extern void lockGfxGlobals();
+extern void unlockGfxGlobals();
+
 extern void warnfeature(const char*feature,char fully);
 extern void infofeature(const char*feature);
 
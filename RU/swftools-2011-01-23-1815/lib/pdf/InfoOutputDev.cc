@@ -963,3 +963,14 @@ void InfoOutputDev::dumpfonts(gfxdevice_t*dev)
         dev->addfont(dev, info->getGfxFont());
     }
 }
+
+gfxfontlist_t* InfoOutputDev::getfontlist()
+{
+    gfxfontlist_t*list = 0;
+    DICT_ITERATE_DATA(fontcache, FontInfo*, info) {
+	gfxfont_t*font = info->getGfxFont();
+	if(font && !gfxfontlist_hasfont(list, font))
+	    list = gfxfontlist_addfont(list, font);
+    }
+    return list;
+}
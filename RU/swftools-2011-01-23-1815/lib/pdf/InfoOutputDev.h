@@ -133,6 +133,7 @@ class InfoOutputDev: public OutputDev
     double average_char_size;
 
     void dumpfonts(gfxdevice_t*dev);
+    gfxfontlist_t* getfontlist();
     FontInfo* getFontInfo(GfxState*state);
 
     InfoOutputDev(XRef*xref);
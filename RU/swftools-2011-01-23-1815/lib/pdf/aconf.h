@@ -15,6 +15,12 @@
 
 #define TEXTOUT_WORD_LIST 1
 
+/* pdf.cc renders pages in several threads if asked to, so let
+   xpdf protect its global caches */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#define MULTITHREADED 1
+#endif
+
 // todo:
 //
 // HAVE_STRINGS_H
@@ -3,6 +3,7 @@
 #include "../gfxdevice.h"
 #include "../gfxsource.h"
 #include "../devices/rescale.h"
+#include "../devices/record.h"
 #include "../log.h"
 #include "../../config.h"
 #ifdef HAVE_POPPLER
@@ -21,12 +22,16 @@
 #define NO_ARGPARSER
 #include "../args.h"
 #include "../utf8.h"
+#ifdef MULTITHREADED
+#include <pthread.h>
+#endif
 
 static double zoom = 72; /* xpdf: 86 */
 static int zoomtowidth = 0;
 static double multiply = 1.0;
 static char* global_page_range = 0;
 static int threadsafe = 0;
+static int num_threads = 1;
 
 static int globalparams_count=0;
 
@@ -40,6 +45,23 @@ typedef struct _pdf_page_info
     char has_info;
 } pdf_page_info_t;
 
+#define PRERENDER_QUEUED 0
+#define PRERENDER_BUSY 1
+#define PRERENDER_DONE 2
+#define PRERENDER_DISCARD 3
+#define PRERENDER_CONSUMED 4
+
+/* how many pages, per thread, may be rendered ahead of the page
+   currently being written out */
+#define PRERENDER_AHEAD 2
+
+typedef struct _pdf_prerender
+{
+    int x,y,x1,y1,x2,y2;
+    gfxdevice_t*record;
+    char state;
+} pdf_prerender_t;
+
 typedef struct _pdf_doc_internal
 {
     char config_bitmap_optimizing;
@@ -68,6 +90,21 @@ typedef struct _pdf_doc_internal
     int pagemap_pos;
 
     gfxsource_t*parent;
+
+    /* pages rendered ahead of time by worker threads */
+    pdf_prerender_t*prerender;
+    int num_prerender;
+    gfxfontlist_t*fontlist;
+#ifdef MULTITHREADED
+    pthread_t*threads;
+    int num_threads;
+    int next_page;
+    int replay_page;
+    int pending;
+    char shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
 } pdf_doc_internal_t;
 
 typedef struct _pdf_page_internal
@@ -102,26 +139,24 @@ void pdfpage_destroy(gfxpage_t*pdf_page)
     free(pdf_page);pdf_page=0;
 }
 
-static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,int x2,int y2)
+/* render page nr of doc (which is either pi->doc or, in a worker
+   thread, a PDFDoc of its own) to dev */
+static void render_page(pdf_doc_internal_t*pi, PDFDoc*doc, int nr, gfxdevice_t*dev, int x,int y, int x1,int y1,int x2,int y2)
 {
-    pdf_doc_internal_t*pi = (pdf_doc_internal_t*)page->parent->internal;
     gfxsource_internal_t*i = (gfxsource_internal_t*)pi->parent->internal;
 
-    if(!pi->config_print && pi->nocopy) {msg("<fatal> PDF disallows copying");exit(0);}
-    if(pi->config_print && pi->noprint) {msg("<fatal> PDF disallows printing");exit(0);}
-
     CommonOutputDev*outputDev = 0;
     if(pi->config_full_bitmap_optimizing) {
-	FullBitmapOutputDev*d = new FullBitmapOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
+	FullBitmapOutputDev*d = new FullBitmapOutputDev(pi->info, doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
 	outputDev = (CommonOutputDev*)d;
     } else if(pi->config_bitmap_optimizing) {
-	BitmapOutputDev*d = new BitmapOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
+	BitmapOutputDev*d = new BitmapOutputDev(pi->info, doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
 	outputDev = (CommonOutputDev*)d;
     } else if(pi->config_only_text) {
-	CharOutputDev*d = new CharOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
+	CharOutputDev*d = new CharOutputDev(pi->info, doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
 	outputDev = (CommonOutputDev*)d;
     } else {
-	VectorGraphicOutputDev*d = new VectorGraphicOutputDev(pi->info, pi->doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
+	VectorGraphicOutputDev*d = new VectorGraphicOutputDev(pi->info, doc, pi->pagemap, pi->pagemap_pos, x, y, x1, y1, x2, y2);
 	outputDev = (CommonOutputDev*)d;
     }
 
@@ -144,24 +179,14 @@ static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,
         gfxdevice_rescale_setdevice(middev, dev);
 	dev = middev;
     } 
-	
-    if(!pi) {
-	msg("<fatal> pdf_page_render: Parent PDF this page belongs to doesn't exist yet/anymore");
-	return;
-    }
-
-    if(!pi->pages[page->nr-1].has_info) {
-	msg("<fatal> pdf_page_render: page %d was previously set as not-to-render via the \"pages\" option", page->nr);
-	return;
-    }
 
     if(pi->protect) {
         dev->setparameter(dev, "protect", "1");
     }
 
     outputDev->setDevice(dev);
-    pi->doc->processLinks((OutputDev*)outputDev, page->nr);
-    pi->doc->displayPage((OutputDev*)outputDev, page->nr, zoom*multiply, zoom*multiply, /*rotate*/0, true, true, pi->config_print);
+    doc->processLinks((OutputDev*)outputDev, nr);
+    doc->displayPage((OutputDev*)outputDev, nr, zoom*multiply, zoom*multiply, /*rotate*/0, true, true, pi->config_print);
     outputDev->finishPage();
     outputDev->setDevice(0);
     delete outputDev;
@@ -170,7 +195,204 @@ static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,
 	gfxdevice_rescale_setdevice(middev, 0x00000000);
 	middev->finish(middev);
     }
+}
+
+#ifdef MULTITHREADED
+static void free_record(gfxdevice_t*record)
+{
+    gfxresult_t*r = record->finish(record);
+    r->destroy(r);
+    free(record);
+}
+
+static void* prerender_thread(void*data)
+{
+    pdf_doc_internal_t*pi = (pdf_doc_internal_t*)data;
+
+    /* xpdf's object trees are not thread safe, so every worker
+       parses the file on its own */
+    PDFDoc*doc = new PDFDoc(new GString(pi->fileName), pi->userPW);
+
+    pthread_mutex_lock(&pi->mutex);
+    while(1) {
+	while(pi->next_page <= pi->num_prerender &&
+	      pi->prerender[pi->next_page-1].state != PRERENDER_QUEUED)
+	    pi->next_page++;
+	if(pi->shutdown || pi->next_page > pi->num_prerender)
+	    break;
+	if(pi->pending >= PRERENDER_AHEAD*pi->num_threads) {
+	    pthread_cond_wait(&pi->cond, &pi->mutex);
+	    continue;
+	}
+	int nr = pi->next_page++;
+	pdf_prerender_t*p = &pi->prerender[nr-1];
+	p->state = PRERENDER_BUSY;
+	pi->pending++;
+	pthread_mutex_unlock(&pi->mutex);
+
+	gfxdevice_t*record = (gfxdevice_t*)malloc(sizeof(gfxdevice_t));
+	gfxdevice_record_init(record, 0);
+	render_page(pi, doc, nr, record, p->x, p->y, p->x1, p->y1, p->x2, p->y2);
+
+	pthread_mutex_lock(&pi->mutex);
+	if(p->state == PRERENDER_DISCARD) {
+	    free_record(record);
+	    p->state = PRERENDER_CONSUMED;
+	    pi->pending--;
+	} else {
+	    p->record = record;
+	    p->state = PRERENDER_DONE;
+	}
+	pthread_cond_broadcast(&pi->cond);
+    }
+    pthread_mutex_unlock(&pi->mutex);
+
+    delete doc;
+    return 0;
+}
+
+/* drop a page which was (or is being) rendered ahead of time. Called
+   with pi->mutex held. */
+static void prerender_discard(pdf_doc_internal_t*pi, pdf_prerender_t*p)
+{
+    if(p->state == PRERENDER_QUEUED) {
+	p->state = PRERENDER_CONSUMED;
+    } else if(p->state == PRERENDER_BUSY) {
+	p->state = PRERENDER_DISCARD;
+    } else if(p->state == PRERENDER_DONE) {
+	free_record(p->record);p->record = 0;
+	p->state = PRERENDER_CONSUMED;
+	pi->pending--;
+    }
+}
+
+/* returns the recorded page nr if a worker thread rendered it with the
+   given parameters, waiting for the thread if necessary. Returns 0 if the
+   page has to be rendered by the caller. */
+static gfxdevice_t* prerender_get(pdf_doc_internal_t*pi, int nr, int x,int y, int x1,int y1,int x2,int y2)
+{
+    gfxdevice_t*record = 0;
+    pthread_mutex_lock(&pi->mutex);
+
+    /* pages are written out in ascending order, so anything we skipped
+       won't be asked for anymore */
+    for(;pi->replay_page < nr;pi->replay_page++) {
+	prerender_discard(pi, &pi->prerender[pi->replay_page-1]);
+    }
+    pdf_prerender_t*p = &pi->prerender[nr-1];
+    if(p->state == PRERENDER_QUEUED) {
+	/* no worker got to it yet- do it ourselves */
+	p->state = PRERENDER_CONSUMED;
+    }
+    while(p->state == PRERENDER_BUSY) {
+	pthread_cond_wait(&pi->cond, &pi->mutex);
+    }
+    if(p->state == PRERENDER_DONE) {
+	if(p->x == x && p->y == y && p->x1 == x1 && p->y1 == y1 && p->x2 == x2 && p->y2 == y2) {
+	    record = p->record;p->record = 0;
+	    p->state = PRERENDER_CONSUMED;
+	    pi->pending--;
+	} else {
+	    prerender_discard(pi, p);
+	}
+    }
+    if(pi->replay_page == nr)
+	pi->replay_page++;
+
+    pthread_cond_broadcast(&pi->cond);
+    pthread_mutex_unlock(&pi->mutex);
+    return record;
+}
+
+static void prerender_start(pdf_doc_internal_t*pi, int num_pages)
+{
+    pi->num_prerender = num_pages;
+    pi->prerender = (pdf_prerender_t*)rfx_calloc(sizeof(pdf_prerender_t)*num_pages);
+    int t;
+    for(t=0;t<num_pages;t++) {
+	pdf_prerender_t*p = &pi->prerender[t];
+	if(!pi->pages[t].has_info) {
+	    p->state = PRERENDER_CONSUMED;
+	    continue;
+	}
+	/* the parameters pdfpage_rendersection() is called with for
+	   a full page at the origin, which is what pdf2swf does */
+	int x2 = pi->pages[t].width, y2 = pi->pages[t].height;
+	if((x2|y2)==0) x2++;
+	p->x2 = (int)(x2*multiply);
+	p->y2 = (int)(y2*multiply);
+	p->state = PRERENDER_QUEUED;
+    }
 
+    /* the replayed pages refer to the fonts which were passed to the
+       output device in pdf_doc_prepare() */
+    pi->fontlist = pi->info->getfontlist();
+    /* create the globals before there's a chance of two threads
+       doing it at the same time */
+    getGfxGlobals();
+
+    pthread_mutex_init(&pi->mutex, 0);
+    pthread_cond_init(&pi->cond, 0);
+    pi->next_page = 1;
+    pi->replay_page = 1;
+    pi->num_threads = num_threads;
+    pi->threads = (pthread_t*)rfx_calloc(sizeof(pthread_t)*num_threads);
+    for(t=0;t<num_threads;t++) {
+	pthread_create(&pi->threads[t], 0, prerender_thread, pi);
+    }
+    msg("<verbose> Rendering pages in %d threads", num_threads);
+}
+
+static void prerender_stop(pdf_doc_internal_t*pi)
+{
+    pthread_mutex_lock(&pi->mutex);
+    pi->shutdown = 1;
+    pthread_cond_broadcast(&pi->cond);
+    pthread_mutex_unlock(&pi->mutex);
+    int t;
+    for(t=0;t<pi->num_threads;t++) {
+	pthread_join(pi->threads[t], 0);
+    }
+    free(pi->threads);pi->threads = 0;
+    for(t=0;t<pi->num_prerender;t++) {
+	if(pi->prerender[t].record)
+	    free_record(pi->prerender[t].record);
+    }
+    free(pi->prerender);pi->prerender = 0;
+    gfxfontlist_free(pi->fontlist, 0);pi->fontlist = 0;
+    pthread_cond_destroy(&pi->cond);
+    pthread_mutex_destroy(&pi->mutex);
+}
+#endif
+
+static void render2(gfxpage_t*page, gfxdevice_t*dev, int x,int y, int x1,int y1,int x2,int y2)
+{
+    pdf_doc_internal_t*pi = (pdf_doc_internal_t*)page->parent->internal;
+
+    if(!pi) {
+	msg("<fatal> pdf_page_render: Parent PDF this page belongs to doesn't exist yet/anymore");
+	return;
+    }
+
+    if(!pi->config_print && pi->nocopy) {msg("<fatal> PDF disallows copying");exit(0);}
+    if(pi->config_print && pi->noprint) {msg("<fatal> PDF disallows printing");exit(0);}
+
+    if(!pi->pages[page->nr-1].has_info) {
+	msg("<fatal> pdf_page_render: page %d was previously set as not-to-render via the \"pages\" option", page->nr);
+	return;
+    }
+
+#ifdef MULTITHREADED
+    if(pi->threads) {
+	gfxdevice_t*record = prerender_get(pi, page->nr, x, y, x1, y1, x2, y2);
+	if(record) {
+	    gfxdevice_record_flush(record, dev, &pi->fontlist);
+	    free_record(record);
+	    return;
+	}
+    }
+#endif
+    render_page(pi, pi->doc, page->nr, dev, x, y, x1, y1, x2, y2);
 }
 
     
@@ -195,6 +417,12 @@ void pdf_doc_destroy(gfxdocument_t*gfx)
 {
     pdf_doc_internal_t*i= (pdf_doc_internal_t*)gfx->internal;
 
+#ifdef MULTITHREADED
+    if(i->threads) {
+	prerender_stop(i);
+    }
+#endif
+
     if (i->userPW) {
 	delete i->userPW;i->userPW = 0;
     }
@@ -448,6 +676,12 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
         addGlobalLanguageDir(value);
     } else if(!strcmp(name, "threadsafe")) {
 	threadsafe = atoi(value);
+    } else if(!strcmp(name, "threads")) {
+	num_threads = atoi(value);
+#ifndef MULTITHREADED
+	if(num_threads>1)
+	    msg("<warning> No thread support compiled in, rendering pages sequentially");
+#endif
     } else if(!strcmp(name, "zoomtowidth")) {
 	zoomtowidth = atoi(value);
     } else if(!strcmp(name, "zoom")) {
@@ -467,6 +701,7 @@ static void pdf_setparameter(gfxsource_t*src, const char*name, const char*value)
 	printf("multiply=<times>  Render everything at <times> the resolution\n");
 	printf("poly2bitmap       Convert graphics to bitmaps\n");
 	printf("bitmap            Convert everything to bitmaps\n");
+	printf("threads=<n>       Render pages ahead of time in <n> threads\n");
     }	
 }
 
@@ -474,6 +709,11 @@ void pdf_doc_prepare(gfxdocument_t*doc, gfxdevice_t*dev)
 {
     pdf_doc_internal_t*i= (pdf_doc_internal_t*)doc->internal;
     i->info->dumpfonts(dev);
+#ifdef MULTITHREADED
+    if(num_threads>1 && !i->threads) {
+	prerender_start(i, doc->num_pages);
+    }
+#endif
 }
 
 static gfxdocument_t*pdf_open(gfxsource_t*src, const char*filename)
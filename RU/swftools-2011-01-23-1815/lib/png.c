@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include <limits.h>
+#include "./bitio.h"
 
 #ifdef EXPORT
 #undef EXPORT
@@ -1114,6 +1115,29 @@ static int test_line(z_stream*zs_orig, Bytef*line, int linelen)
     return size;
 }
 
+/* writer for the parallel deflater, appends to the current chunk */
+static int png_idat_write(writer_t*w, void*data, int len)
+{
+    png_write_bytes((FILE*)w->internal, (unsigned char*)data, len);
+    w->pos += len;
+    return len;
+}
+static void png_idat_flush(writer_t*w)
+{
+}
+static void png_idat_finish(writer_t*w)
+{
+    memset(w, 0, sizeof(writer_t));
+}
+static void png_init_idatwriter(writer_t*w, FILE*fi)
+{
+    memset(w, 0, sizeof(writer_t));
+    w->write = png_idat_write;
+    w->flush = png_idat_flush;
+    w->finish = png_idat_finish;
+    w->internal = fi;
+}
+
 static int finishzlib(z_stream*zs, FILE*fi)
 {
     int size = 0;
@@ -1523,7 +1547,9 @@ int png_apply_filter_32(unsigned char*dest, unsigned char*src, unsigned width, i
     return png_apply_filter(dest, src, width, y, 32);
 }
 
-static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression)
+/* threads and blocksize are passed to writer_init_zlibdeflate_parallel().
+   1 thread = single zlib stream */
+static void png_write_palette_based2(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors, int compression, int threads, int blocksize)
 {
     FILE*fi;
     int crc;
@@ -1541,6 +1567,8 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
     int ret;
     char has_alpha=0;
     z_stream zs;
+    writer_t idatwriter, zwriter;
+    char parallel = threads != 1;
     COL palette[256];
 
     make_crc32_table();
@@ -1622,10 +1650,15 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
     zs.opaque = Z_NULL;
     zs.next_out = writebuf;
     zs.avail_out = ZLIB_BUFFER_SIZE;
-    ret = deflateInit(&zs, compression);
-    if (ret != Z_OK) {
-	fprintf(stderr, "error in deflateInit(): %s", zs.msg?zs.msg:"unknown");
-	return;
+    if(parallel) {
+	png_init_idatwriter(&idatwriter, fi);
+	writer_init_zlibdeflate_parallel(&zwriter, &idatwriter, compression, blocksize, threads);
+    } else {
+	ret = deflateInit(&zs, compression);
+	if (ret != Z_OK) {
+	    fprintf(stderr, "error in deflateInit(): %s", zs.msg?zs.msg:"unknown");
+	    return;
+	}
     }
 
     long idatsize = 0;
@@ -1675,12 +1708,20 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
             else
 		line[0] = png_apply_filter_32(line+1, &data[y*srcwidth], width, y);
 
-	    idatsize += compress_line(&zs, line, linelen, fi);
+	    if(parallel)
+		zwriter.write(&zwriter, line, linelen);
+	    else
+		idatsize += compress_line(&zs, line, linelen, fi);
 	}
 #endif
 	free(line);
     }
-    idatsize += finishzlib(&zs, fi);
+    if(parallel) {
+	zwriter.finish(&zwriter);
+	idatsize = idatwriter.pos;
+    } else {
+	idatsize += finishzlib(&zs, fi);
+    }
     png_patch_len(fi, idatpos, idatsize);
     png_end_chunk(fi);
 
@@ -1695,17 +1736,21 @@ static void png_write_palette_based2(const char*filename, unsigned char*data, un
 
 EXPORT void png_write_palette_based(const char*filename, unsigned char*data, unsigned width, unsigned height, int numcolors)
 {
-    png_write_palette_based2(filename, data, width, height, numcolors, Z_BEST_COMPRESSION);
+    png_write_palette_based2(filename, data, width, height, numcolors, Z_BEST_COMPRESSION, 1, 0);
 }
 EXPORT void png_write(const char*filename, unsigned char*data, unsigned width, unsigned height)
 {
-    png_write_palette_based2(filename, data, width, height, 0, Z_BEST_COMPRESSION);
+    png_write_palette_based2(filename, data, width, height, 0, Z_BEST_COMPRESSION, 1, 0);
 }
 EXPORT void png_write_quick(const char*filename, unsigned char*data, unsigned width, unsigned height)
 {
-    png_write_palette_based2(filename, data, width, height, 257, Z_NO_COMPRESSION);
+    png_write_palette_based2(filename, data, width, height, 257, Z_NO_COMPRESSION, 1, 0);
 }
 EXPORT void png_write_palette_based_2(const char*filename, unsigned char*data, unsigned width, unsigned height)
 {
-    png_write_palette_based2(filename, data, width, height, 256, Z_BEST_COMPRESSION);
+    png_write_palette_based2(filename, data, width, height, 256, Z_BEST_COMPRESSION, 1, 0);
+}
+EXPORT void png_write_threaded(const char*filename, unsigned char*data, unsigned width, unsigned height, char palette, int threads, int blocksize)
+{
+    png_write_palette_based2(filename, data, width, height, palette?256:0, Z_BEST_COMPRESSION, threads, blocksize);
 }
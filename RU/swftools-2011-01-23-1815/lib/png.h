@@ -35,6 +35,10 @@ void png_write(const char*filename, unsigned char*data, unsigned width, unsigned
 void png_write_quick(const char*filename, unsigned char*data, unsigned width, unsigned height);
 void png_write_palette_based_2(const char*filename, unsigned char*data, unsigned width, unsigned height);
 
+/* like png_write (or png_write_palette_based_2 if palette is set), compressing with
+   <threads> threads (1 = single zlib stream, 0 = one per cpu) in blocks of <blocksize> bytes (0 = 128k) */
+void png_write_threaded(const char*filename, unsigned char*data, unsigned width, unsigned height, char palette, int threads, int blocksize);
+
 #ifdef __cplusplus
 }
 #endif
@@ -200,32 +200,33 @@ int swf_SetU32(TAG * t,U32 v)
   return 0;
 }
 
+/* Bit access works on up to 5 bytes at once, collected in a 64 bit
+   accumulator. readBit/writeBit hold the number of bits already used
+   in the current byte (0 = byte aligned). */
+
 U32 swf_GetBits(TAG * t,int nbits)
-{ U32 res = 0;
+{ U64 acc = 0;
+  U8 * p;
+  int total, nbytes, i;
   if (!nbits) return 0;
-  if (!t->readBit) t->readBit = 0x80;
-  while (nbits)
-  { res<<=1;
+  total = t->readBit + nbits;
+  nbytes = (total+7)>>3;
 #ifdef DEBUG_RFXSWF
-    if (t->pos>=t->len) 
-    { fprintf(stderr,"GetBits() out of bounds: TagID = %i, pos=%d, len=%d\n",t->id, t->pos, t->len);
-      int i,m=t->len>10?10:t->len;
-      for(i=-1;i<m;i++) {
-        fprintf(stderr, "(%d)%02x ", i, t->data[i]);
-      } 
-      fprintf(stderr, "\n");
-      return res;
-    }
-#endif
-    if (t->data[t->pos]&t->readBit) res|=1;
-    t->readBit>>=1;
-    nbits--;
-    if (!t->readBit)
-    { if (nbits) t->readBit = 0x80;
-      t->pos++;
-    }
+  if (t->pos+nbytes>t->len) 
+  { fprintf(stderr,"GetBits() out of bounds: TagID = %i, pos=%d, len=%d\n",t->id, t->pos, t->len);
+    int m=t->len>10?10:t->len;
+    for(i=-1;i<m;i++) {
+      fprintf(stderr, "(%d)%02x ", i, t->data[i]);
+    } 
+    fprintf(stderr, "\n");
+    return 0;
   }
-  return res;
+#endif
+  p = &t->data[t->pos];
+  for (i=0;i<nbytes;i++) acc = (acc<<8)|p[i];
+  t->pos += total>>3;
+  t->readBit = total&7;
+  return (U32)((acc>>((nbytes<<3)-total))&((((U64)1)<<nbits)-1));
 }
 
 S32 swf_GetSBits(TAG * t,int nbits)
@@ -244,18 +245,30 @@ S32 reader_GetSBits(reader_t*reader, int nbits)
 }
 
 int swf_SetBits(TAG * t,U32 v,int nbits)
-{ U32 bm = 1<<(nbits-1);
-
-  while (nbits)
-  { if (!t->writeBit)
-    { if (FAILED(swf_SetU8(t,0))) return -1;
-      t->writeBit = 0x80;
-    }
-    if (v&bm) t->data[t->len-1] |= t->writeBit;
-    bm>>=1;
-    t->writeBit>>=1;
-    nbits--;
+{ U64 acc;
+  U8 * p;
+  int total, nbytes, i;
+  if (nbits<=0) return 0;
+  total = t->writeBit + nbits;
+  nbytes = (total+7)>>3;
+  acc = ((U64)v&((((U64)1)<<nbits)-1))<<((nbytes<<3)-total);
+  if (t->writeBit)
+  { t->len--;
+    acc |= ((U64)t->data[t->len])<<((nbytes-1)<<3);
+  }
+  if (t->len+nbytes>t->memsize)
+  { U32  newmem  = MEMSIZE(t->len+nbytes);
+    U8 * newdata = (U8*)(rfx_realloc(t->data,newmem));
+    t->memsize = newmem;
+    t->data    = newdata;
   }
+  p = &t->data[t->len];
+  for (i=nbytes-1;i>=0;i--)
+  { p[i] = (U8)acc;
+    acc >>= 8;
+  }
+  t->len += nbytes;
+  t->writeBit = total&7;
   return 0;
 }
 
@@ -1622,6 +1635,14 @@ void swf_ReadABCfile(char*filename, SWF*swf)
 
 int no_extra_tags = 0;
 
+static void swf_InitDeflate(SWFWRITER*w, writer_t*output)
+{
+  if(w->deflateThreads != 1)
+    writer_init_zlibdeflate_parallel(&w->zwriter, output, 9, w->deflateBlocksize, w->deflateThreads);
+  else
+    writer_init_zlibdeflate(&w->zwriter, output);
+}
+
 int WriteExtraTags(SWF*swf, writer_t*writer)
 {
     TAG*t = swf->firstTag;
@@ -1630,6 +1651,7 @@ int WriteExtraTags(SWF*swf, writer_t*writer)
     int has_version_8_action=0;
     int has_version_9_action=0;
     int len = 0;
+    int l;
     while(t) {
         if(t->id == ST_FILEATTRIBUTES)
             has_fileattributes = t;
@@ -1655,12 +1677,9 @@ int WriteExtraTags(SWF*swf, writer_t*writer)
                 flags &= ~FILEATTRIBUTE_AS3;
             TAG*fileattrib = swf_InsertTag(0, ST_FILEATTRIBUTES);
             swf_SetU32(fileattrib, flags);
-            if(writer) {
-                if(swf_WriteTag2(writer, fileattrib)<0) 
-                    return -1;
-            } else {
-                len += swf_WriteTag(-1,fileattrib);
-            }
+            if((l = swf_WriteTag2(writer, fileattrib))<0) 
+                return -1;
+            len += l;
             swf_DeleteTag(0, fileattrib);
         } else {
 	    if(swf->fileAttributes) {
@@ -1670,11 +1689,13 @@ int WriteExtraTags(SWF*swf, writer_t*writer)
 	      U32 flags = swf_GetU32(tt) | swf->fileAttributes;
 	      swf_ResetTag(tt, tt->id);
 	      swf_SetU32(tt, flags);
-	      if(swf_WriteTag2(writer, has_fileattributes)<0) return -1;
+	      if((l = swf_WriteTag2(writer, has_fileattributes))<0) return -1;
+	      len += l;
 	      swf_DeleteTag(0, tt);
 	    } else {
-		if(swf_WriteTag2(writer, has_fileattributes)<0) 
+		if((l = swf_WriteTag2(writer, has_fileattributes))<0) 
 		    return -1;
+		len += l;
 	    }
         }
         if(0 && !has_scenedescription) {
@@ -1682,146 +1703,225 @@ int WriteExtraTags(SWF*swf, writer_t*writer)
             swf_SetU16(scene, 1);
             swf_SetString(scene, "Scene 1");
             swf_SetU8(scene, 0);
-            if(writer) {
-                if(swf_WriteTag2(writer, scene)<0) 
-                    return -1;
-            } else {
-                len += swf_WriteTag(-1,scene);
-            }
+            if((l = swf_WriteTag2(writer, scene))<0) 
+                return -1;
+            len += l;
             swf_DeleteTag(0, scene);
         }
     }
     return len;
 }
 
-int  swf_WriteSWF2(writer_t*writer, SWF * swf)     // Writes SWF to file, returns length or <0 if fails
-{ U32 len;
-  TAG * t;
-  int frameCount=0;
-  writer_t zwriter;
-  int fileSize = 0;
-  int inSprite = 0;
-  int ret;
-  writer_t*original_writer = writer;
-  int writer_lastpos = 0;
-    
-  if (!swf) return -1;
-  if (!writer) return -1; // the caller should provide a nullwriter, not 0, for querying SWF size
-
-  if(original_writer) writer_lastpos = original_writer->pos;
-
-  // Count Frames + File Size
-
-  len = 0;
-  t = swf->firstTag;
-  frameCount = 0;
-
-  if(swf->firstTag && !no_extra_tags) {
-    len += WriteExtraTags(swf, 0);
-  }
-  while(t) {
-      len += swf_WriteTag(-1,t);
-      if(t->id == ST_DEFINESPRITE && !swf_IsFolded(t)) inSprite++;
-      else if(t->id == ST_END && inSprite) inSprite--;
-      else if(t->id == ST_END && !inSprite) {
-	if(t->prev && t->prev->id!=ST_SHOWFRAME)
-	  frameCount++;
-      }
-      else if(t->id == ST_SHOWFRAME && !inSprite) frameCount++;
-      t = swf_NextTag(t);
+static void swf_CountFrame(TAG*t, int*inSprite, U16*frameCount)
+{
+  if(t->id == ST_DEFINESPRITE && !swf_IsFolded(t)) (*inSprite)++;
+  else if(t->id == ST_END && *inSprite) (*inSprite)--;
+  else if(t->id == ST_END && !*inSprite) {
+    if(t->prev && t->prev->id!=ST_SHOWFRAME)
+      (*frameCount)++;
   }
-  
-  { TAG t1;
-    char b[64],b4[4];
-    U32 l;
+  else if(t->id == ST_SHOWFRAME && !*inSprite) (*frameCount)++;
+}
 
-    memset(&t1,0x00,sizeof(TAG));
-    t1.data    = (U8*)b;
-    t1.memsize = 64;
-    
-    { // measure header file size
-      TAG t2;
-      char b2[64];
-      memset(&t2,0x00,sizeof(TAG));
-      t2.data    = (U8*)b2;
-      t2.memsize = 64;
-      swf_SetRect(&t2, &swf->movieSize);
-      swf_SetU16(&t2, swf->frameRate);
-      swf_SetU16(&t2, swf->frameCount);
-      l = swf_GetTagLen(&t2)+8;
-    }
-    if(swf->compressed == 8) {
-      l -= 8;
-    }
+static int swf_IsCompressed(SWF*swf)
+{
+  return swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6);
+}
 
-    fileSize = l+len;
-    if(len) {// don't touch headers without tags
-	swf->fileSize = fileSize;
-	swf->frameCount = frameCount;
-    }
+/* The tags are written only once. File size and frame count of the
+   header are patched in at the end if the output allows it. Otherwise,
+   compressed files are collected in memory until the size is known, and
+   uncompressed files (as well as the frame count of compressed ones,
+   which is part of the zlib stream) use what the caller put into swf. */
+int swf_WriteSWFStart(SWFWRITER*w, writer_t*writer, SWF*swf)
+{
+  return swf_WriteSWFStart2(w, writer, swf, 1, 0);
+}
 
-    if(swf->compressed != 8) {
+int swf_WriteSWFStart2(SWFWRITER*w, writer_t*writer, SWF*swf, int threads, int blocksize)
+{ TAG t1;
+  char b[64],b4[4];
+  int ret;
+
+  memset(w, 0, sizeof(SWFWRITER));
+  if (!swf || !writer) return -1;
+  w->deflateThreads = threads;
+  w->deflateBlocksize = blocksize;
+  w->swf = swf;
+  w->output = writer;
+  w->writer = writer;
+  w->startpos = writer->pos;
+  w->patch = writer_patch(writer, writer->pos, 0, 0)>=0;
+
+  memset(&t1,0x00,sizeof(TAG));
+  t1.data    = (U8*)b;
+  t1.memsize = 64;
+  swf_SetRect(&t1,&swf->movieSize);
+  swf_SetU16(&t1,swf->frameRate);
+  swf_SetU16(&t1,swf->frameCount);
+  w->headerLen = swf_GetTagLen(&t1)+8;
+
+  if(swf->compressed == 8) {
     /* compressed flag set to 8 means "skip first 8 
        header bytes". This is necessary if the caller wants to
        create compressed SWFs himself .
        It also means that we don't initialize our own zlib
        writer, but assume the caller provided one.
      */
-      if(swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6)) {
-	char*id = "CWS";
-	writer->write(writer, id, 3);
-      } else {
-	char*id = "FWS";
-	writer->write(writer, id, 3);
-      }
-
-      writer->write(writer, &swf->fileVersion, 1);
-      PUT32(b4, swf->fileSize);
-      writer->write(writer, b4, 4);
-      
-      if(swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6)) {
-	writer_init_zlibdeflate(&zwriter, writer);
-	writer = &zwriter;
-      }
+    w->headerLen -= 8;
+    w->patch = 0;
+  } else if(swf_IsCompressed(swf) && !w->patch) {
+    writer_init_growingmemwriter(&w->buffer, 65536);
+    swf_InitDeflate(w, &w->buffer);
+    w->writer = &w->zwriter;
+    w->buffered = 1;
+  } else {
+    writer->write(writer, swf_IsCompressed(swf)?"CWS":"FWS", 3);
+    writer->write(writer, &swf->fileVersion, 1);
+    PUT32(b4, swf->fileSize);
+    writer->write(writer, b4, 4);
+    if(swf_IsCompressed(swf)) {
+      swf_InitDeflate(w, writer);
+      w->writer = &w->zwriter;
     }
+  }
 
-    swf_SetRect(&t1,&swf->movieSize);
-    swf_SetU16(&t1,swf->frameRate);
-    swf_SetU16(&t1,swf->frameCount);
+  ret = w->writer->write(w->writer,b,swf_GetTagLen(&t1));
+  if (ret!=swf_GetTagLen(&t1))
+  {
+    #ifdef DEBUG_RFXSWF
+      fprintf(stderr, "ret:%d\n",ret);
+      perror("write:");
+      fprintf(stderr,"WriteSWF() failed: Header.\n");
+    #endif
+    return -1;
+  }
 
-    ret = writer->write(writer,b,swf_GetTagLen(&t1));
-    if (ret!=swf_GetTagLen(&t1))
-    {
-      #ifdef DEBUG_RFXSWF
-	fprintf(stderr, "ret:%d\n",ret);
-	perror("write:");
-	fprintf(stderr,"WriteSWF() failed: Header.\n");
-      #endif
+  if(swf->firstTag && !no_extra_tags) {
+    if((ret = WriteExtraTags(swf, w->writer))<0)
       return -1;
+    w->len += ret;
+  }
+  return 0;
+}
+
+static int swf_WriteSWFTags(SWFWRITER*w, TAG*last)
+{ TAG*t = w->lastTag?w->lastTag->next:w->swf->firstTag;
+  int l;
+  while(t) {
+    if(no_extra_tags || t->id != ST_FILEATTRIBUTES) {
+      if((l = swf_WriteTag2(w->writer, t))<0) 
+        return -1;
+      w->len += l;
     }
+    swf_CountFrame(t, &w->inSprite, &w->frameCount);
+    w->lastTag = t;
+    if(t == last)
+      break;
+    t = t->next;
+  }
+  return 0;
+}
+
+int swf_WriteSWFFlush(SWFWRITER*w)
+{ TAG*t = w->lastTag?w->lastTag->next:w->swf->firstTag;
+  TAG*last = 0;
+  int inSprite = w->inSprite;
+  U16 frameCount = 0;
+
+  /* only whole frames outside of sprites, so that sprite
+     sizes are known when their header is written */
+  while(t) {
+    swf_CountFrame(t, &inSprite, &frameCount);
+    if(t->id == ST_SHOWFRAME && !inSprite)
+      last = t;
+    t = t->next;
+  }
+  if(!last)
+    return 0;
+  if(swf_WriteSWFTags(w, last)<0)
+    return -1;
+  if(w->writer->flush)
+    w->writer->flush(w->writer);
+  return 0;
+}
+
+int swf_WriteSWFFinish(SWFWRITER*w)
+{ SWF*swf = w->swf;
+  U32 fileSize;
+  char b4[4];
+
+  if(swf_WriteSWFTags(w, 0)<0)
+    return -1;
 
-    if(swf->firstTag && !no_extra_tags) {
-        WriteExtraTags(swf, writer);
+  fileSize = w->headerLen+w->len;
+  if(w->len) {// don't touch headers without tags
+    swf->fileSize = fileSize;
+    swf->frameCount = w->frameCount;
+  }
+
+  if(swf->compressed == 8)
+    return (int)fileSize;
+
+  PUT32(b4, swf->fileSize);
+  if(w->writer == &w->zwriter) {
+    w->zwriter.finish(&w->zwriter);
+    if(w->buffered) {
+      int len;
+      void*data = writer_growmemwrite_memptr(&w->buffer, &len);
+      w->output->write(w->output, "CWS", 3);
+      w->output->write(w->output, &swf->fileVersion, 1);
+      w->output->write(w->output, b4, 4);
+      w->output->write(w->output, data, len);
+      w->buffer.finish(&w->buffer);
+    } else if(w->len && w->patch) {
+      writer_patch(w->output, w->startpos+4, b4, 4);
     }
-    t = swf->firstTag;
+    return w->output->pos - w->startpos;
+  }
+  if(w->len && w->patch) {
+    U8 fc[2];
+    fc[0] = swf->frameCount&0xff;
+    fc[1] = swf->frameCount>>8;
+    writer_patch(w->output, w->startpos+4, b4, 4);
+    writer_patch(w->output, w->startpos+w->headerLen-2, fc, 2);
+  }
+  return (int)fileSize;
+}
 
-    while (t) { 
-        if(no_extra_tags || t->id != ST_FILEATTRIBUTES) {
-          if(swf_WriteTag2(writer, t)<0) 
-            return -1;
-        }
+int  swf_WriteSWF2(writer_t*writer, SWF * swf)     // Writes SWF to file, returns length or <0 if fails
+{
+  return swf_WriteSWF3(writer, swf, 1, 0);
+}
+
+int  swf_WriteSWF3(writer_t*writer, SWF * swf, int threads, int blocksize)
+{ SWFWRITER w;
+    
+  if (!swf) return -1;
+  if (!writer) return -1; // the caller should provide a nullwriter, not 0, for querying SWF size
+
+  if(swf->firstTag) {
+    if(swf_IsCompressed(swf) || swf->compressed == 8) {
+      /* the frame count is inside the zlib stream */
+      TAG*t = swf->firstTag;
+      int inSprite = 0;
+      U16 frameCount = 0;
+      while(t) {
+        swf_CountFrame(t, &inSprite, &frameCount);
         t = t->next;
-    }
-    if(swf->compressed==1 || (swf->compressed==0 && swf->fileVersion>=6) || swf->compressed==8) {
-      if(swf->compressed != 8) {
-	zwriter.finish(&zwriter);
-	return original_writer->pos - writer_lastpos;
       }
-      return (int)fileSize;
-    } else {
-      return (int)fileSize;
+      swf->frameCount = frameCount;
+    } else if(writer_patch(writer, writer->pos, 0, 0)<0) {
+      /* can't go back to fix the header, so measure first */
+      writer_t nullwriter;
+      writer_init_nullwriter(&nullwriter);
+      swf_WriteSWF2(&nullwriter, swf);
     }
   }
+
+  if(swf_WriteSWFStart2(&w, writer, swf, threads, blocksize)<0)
+    return -1;
+  return swf_WriteSWFFinish(&w);
 }
 
 int swf_SaveSWF(SWF * swf, char*filename)
@@ -1935,3 +2035,131 @@ void swf_FreeTags(SWF * swf)                 // Frees all malloc'ed memory for t
 //#include "modules/swfdraw.c"
 //#include "modules/swfrender.c"
 //#include "modules/swffilter.c"
+
+#ifdef MAIN
+/* Micro-benchmark for the bit access functions, against the former
+   bit-by-bit implementation. Build in lib/ with e.g.
+   gcc -O2 -DHAVE_CONFIG_H -DMAIN -DSWFTOOLS_DATADIR='"."' rfxswf.c modules/swfshape.c \
+       modules/swftools.c modules/swffilter.c modules/swfobject.c modules/swfdump.c \
+       mem.c bitio.c os.c -lz -lm -o bitbench
+*/
+/* the old versions keep the bit mask of their own, as readBit/writeBit
+   used to do */
+static U8 old_readBit = 0;
+static U8 old_writeBit = 0;
+
+static U32 old_GetBits(TAG * t,int nbits)
+{ U32 res = 0;
+  if (!nbits) return 0;
+  if (!old_readBit) old_readBit = 0x80;
+  while (nbits)
+  { res<<=1;
+    if (t->data[t->pos]&old_readBit) res|=1;
+    old_readBit>>=1;
+    nbits--;
+    if (!old_readBit)
+    { if (nbits) old_readBit = 0x80;
+      t->pos++;
+    }
+  }
+  return res;
+}
+static int old_SetBits(TAG * t,U32 v,int nbits)
+{ U32 bm = 1<<(nbits-1);
+  while (nbits)
+  { if (!old_writeBit)
+    { if (FAILED(swf_SetU8(t,0))) return -1;
+      old_writeBit = 0x80;
+    }
+    if (v&bm) t->data[t->len-1] |= old_writeBit;
+    bm>>=1;
+    old_writeBit>>=1;
+    nbits--;
+  }
+  return 0;
+}
+
+#define BENCH_RECORDS 2000000
+
+static double seconds(clock_t c)
+{
+    return (double)c/CLOCKS_PER_SEC;
+}
+
+int main()
+{
+    U32*values = (U32*)malloc(BENCH_RECORDS*sizeof(U32));
+    U8*bits = (U8*)malloc(BENCH_RECORDS);
+    TAG*t1 = swf_InsertTag(0, ST_DEFINESHAPE);
+    TAG*t2 = swf_InsertTag(0, ST_DEFINESHAPE);
+    U32 seed = 0x12345678;
+    int i, errors = 0;
+    clock_t c;
+    double told, tnew;
+    SHAPE*shape;
+    RGBA red = {255,255,0,0};
+    SRECT r = {0,0,20*1024,20*1024};
+
+    /* widths as in shape and glyph records: mostly flags and small deltas */
+    for(i=0;i<BENCH_RECORDS;i++) {
+	seed = seed*1103515245+12345;
+	bits[i] = (seed>>28)<4 ? 1 + (seed>>24)%6 : 1 + (seed>>20)%32;
+	values[i] = (seed*2654435761u) & (bits[i]==32?0xffffffff:(1u<<bits[i])-1);
+    }
+
+    c = clock();
+    for(i=0;i<BENCH_RECORDS;i++)
+	old_SetBits(t1, values[i], bits[i]);
+    told = seconds(clock()-c);
+    c = clock();
+    for(i=0;i<BENCH_RECORDS;i++)
+	swf_SetBits(t2, values[i], bits[i]);
+    tnew = seconds(clock()-c);
+    printf("write: old %.3fs new %.3fs (%d bytes)\n", told, tnew, t2->len);
+    if(t1->len != t2->len || memcmp(t1->data, t2->data, t1->len)) {
+	printf("write: output differs\n");
+	errors++;
+    }
+
+    c = clock();
+    for(i=0;i<BENCH_RECORDS;i++)
+	if(old_GetBits(t1, bits[i]) != values[i])
+	    errors++;
+    told = seconds(clock()-c);
+    c = clock();
+    for(i=0;i<BENCH_RECORDS;i++)
+	if(swf_GetBits(t2, bits[i]) != values[i])
+	    errors++;
+    tnew = seconds(clock()-c);
+    printf("read:  old %.3fs new %.3fs\n", told, tnew);
+
+    /* shape throughput with the current implementation */
+    swf_ResetTag(t2, ST_DEFINESHAPE);
+    swf_ShapeNew(&shape);
+    swf_ShapeAddSolidFillStyle(shape, &red);
+    swf_SetU16(t2, 1);
+    swf_SetRect(t2, &r);
+    swf_SetShapeHeader(t2, shape);
+    swf_ShapeSetAll(t2, shape, 0, 0, 0, 1, 0);
+    c = clock();
+    for(i=0;i<BENCH_RECORDS/2;i++) {
+	seed = seed*1103515245+12345;
+	if(seed&0x100)
+	    swf_ShapeSetLine(t2, shape, (seed>>16&1023)-512, (seed>>6&1023)-512);
+	else
+	    swf_ShapeSetCurve(t2, shape, (seed>>16&255)-128, (seed>>8&255)-128,
+					 (seed>>20&255)-128, (seed>>4&255)-128);
+    }
+    swf_ShapeSetEnd(t2);
+    printf("shape: %d edges in %.3fs (%d bytes)\n", BENCH_RECORDS/2, seconds(clock()-c), t2->len);
+
+    swf_ShapeFree(shape);
+    swf_DeleteTag(0, t1);
+    swf_DeleteTag(0, t2);
+    free(values);
+    free(bits);
+    if(errors)
+	printf("%d errors\n", errors);
+    return errors?1:0;
+}
+#endif
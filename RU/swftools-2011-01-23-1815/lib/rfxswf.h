@@ -123,8 +123,8 @@ typedef struct _TAG             // NEVER access a Tag-Struct directly !
   struct _TAG * next;
   struct _TAG * prev;
 
-  U8            readBit;        // for Bit-Manipulating Functions [read]
-  U8            writeBit;       // [write]
+  U8            readBit;        // for Bit-Manipulating Functions [read]: bits used in data[pos]
+  U8            writeBit;       // [write]: bits used in data[len-1], 0 = byte aligned
 
 } TAG;
 
@@ -165,12 +165,31 @@ typedef struct _SWF
   U32           fileAttributes; // for SWFs >= Flash9
 } SWF;
 
+typedef struct _SWFWRITER       // for writing a SWF while tags are still being added
+{ SWF *         swf;
+  writer_t *    output;
+  writer_t *    writer;         // output, or the zlib writer in front of it
+  writer_t      zwriter;
+  writer_t      buffer;         // compressed data, if output can't be patched
+  char          buffered;
+  char          patch;          // file size and frame count are patched into output
+  int           startpos;       // output->pos at the start of the file
+  U32           headerLen;
+  U32           len;            // tag bytes written so far
+  U16           frameCount;
+  int           inSprite;
+  TAG *         lastTag;        // last tag written
+  int           deflateThreads; // see swf_WriteSWF3
+  int           deflateBlocksize;
+} SWFWRITER;
+
 // Basic Functions
 
 SWF* swf_OpenSWF(char*filename);
 int  swf_ReadSWF2(reader_t*reader, SWF * swf);   // Reads SWF via callback
 int  swf_ReadSWF(int handle,SWF * swf);     // Reads SWF to memory (malloc'ed), returns length or <0 if fails
 int  swf_WriteSWF2(writer_t*writer, SWF * swf);     // Writes SWF via callback, returns length or <0 if fails
+int  swf_WriteSWF3(writer_t*writer, SWF * swf, int threads, int blocksize); // Like swf_WriteSWF2, compressing on <threads> threads (1 = single zlib stream, 0 = one per cpu) in blocks of <blocksize> bytes (0 = 128k)
 int  swf_WriteSWF(int handle,SWF * swf);    // Writes SWF to file, returns length or <0 if fails
 int  swf_SaveSWF(SWF * swf, char*filename);
 int  swf_WriteCGI(SWF * swf);               // Outputs SWF with valid CGI header to stdout
@@ -186,6 +205,11 @@ int  swf_WriteTag2(writer_t*writer, TAG * t); //Write TAG via callback
 
 int  swf_ReadHeader(reader_t*reader, SWF * swf);   // Reads SWF Header via callback
 
+int  swf_WriteSWFStart(SWFWRITER*w, writer_t*writer, SWF*swf); // Writes header, file size and frame count come later
+int  swf_WriteSWFStart2(SWFWRITER*w, writer_t*writer, SWF*swf, int threads, int blocksize); // Same, with compression threads as in swf_WriteSWF3
+int  swf_WriteSWFFlush(SWFWRITER*w);      // Writes all complete frames not yet written
+int  swf_WriteSWFFinish(SWFWRITER*w);     // Writes the remaining tags, returns length like swf_WriteSWF2
+
 // folding/unfolding:
 
 void swf_FoldAll(SWF*swf);
@@ -67,7 +67,7 @@ int args_callback_option(char*name,char*val)
 	    *c = 0;
 	    c++;
 	    p->name = s;
-	    p->value = s;
+	    p->value = c;
 	} else {
 	    p->name = s;
 	    p->value = "1";
@@ -98,6 +98,7 @@ void args_callback_usage(char *name)
     printf("-h , --help                    Print short help message and exit\n");
     printf("-l , --legacy                  Use old rendering framework\n");
     printf("-o , --output		   Output file (default: output.png)\n");
+    printf("-s <name>=<value>              Set a parameter (e.g. zlibthreads=<num> to compress on <num> threads)\n");
     printf("\n");
 }
 int args_callback_command(char*name,char*val)